@@ -31,9 +31,8 @@
 #define MAX_UDP_SOCKETS		16
 #define MAX_TCP_SOCKETS		4
 
-#define TCP_TX_BUF_SIZE		220
-#define IP_TX_BUF_SIZE		256
-#define NE2K_RX_BUF_SIZE	256
+#define TCP_MSS				536
+#define NE2K_RX_HDR_SIZE	96
 #define TCP_RX_BUF_MIN_SIZE	0.5
 
 #define UART_BAUD			115200
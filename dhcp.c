@@ -120,6 +120,8 @@ unsigned int dhcp_retrieveIP(void)
 	/** Loop until answer is recieved... or timeout occurs */
 	while(socket->state != SOCKETSTATE_ESTABLISHED) {
 
+		ip_poll();
+
 		/** UDP is unreliable (as if), thus, repeat sending the request */
 		if(globalTimer - tic1 > 100) {
 			
@@ -215,6 +217,8 @@ unsigned int dhcp_retrieveIP(void)
 	tic0 = tic1 = globalTimer;
 	while(socket->state != SOCKETSTATE_ESTABLISHED) {
 
+		ip_poll();
+
 		/** UDP is unreliable (as if), thus, repeat sending the request */
 		
 		if(globalTimer - tic1 > 100) {
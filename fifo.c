@@ -101,6 +101,18 @@ char fifo_getc(fifo *fin)
 	return chr;
 }
 
+/*
+ * fifo_peek(fin, offset)
+ *
+ * Return the character at the given offset from the read pointer without
+ * removing it from the fifo. The caller must make sure that the offset is
+ * smaller than fifo_length().
+ */
+char fifo_peek(fifo *fin, unsigned int offset)
+{
+	return fin->addr[(fin->readPtr + offset) % fin->size];
+}
+
 /*
  * fifo_memchr(fin, chr)
  *
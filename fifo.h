@@ -47,6 +47,7 @@ typedef struct
 void fifo_initialize(fifo *fout, int fsize, char *faddr);
 int fifo_putc(fifo *fout, char chr);
 char fifo_getc(fifo *fout);
+char fifo_peek(fifo *fin, unsigned int offset);
 unsigned int fifo_memchr(fifo *fin, char chr);
 unsigned int fifo_length(fifo *fin);
 unsigned int fifo_size(fifo *fin);
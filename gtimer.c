@@ -27,7 +27,6 @@
 
 #include "config.h"
 #include "gtimer.h"
-#include "tcp.h"
 #include "ip.h"
 
 #include <stdio.h>
@@ -49,8 +48,7 @@ extern addrCL arpTable[MAX_ARP_ENTRIES];
 SIGNAL (TIMER0_OVF_vect)
 {
 	globalTimer++;
-	tcp_sustain();
-	
+
 	int i;
 	for(i = 0; i < MAX_ARP_ENTRIES; i++) {
 		if(arpTable[i].state == ARPSTATE_ENABLED) {
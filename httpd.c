@@ -214,7 +214,8 @@ void httpd_start(unsigned int port, char * files[],
 		tcp_listen(socket);
 
 		/* Wait until the socket gets connected */
-		while(socket->state != TCPSOCKETSTATE_ESTABLISHED) ;
+		while(socket->state != TCPSOCKETSTATE_ESTABLISHED)
+			ip_poll();
 
 		/* Give some time to enter the command */
 		tcp_setTimeout(socket, 1000);
@@ -29,6 +29,7 @@
 
 #include "ip.h"
 #include "icmp.h"
+#include "ne2k.h"
 #include "config.h"
 
 /*
@@ -47,28 +48,34 @@ extern char localIP[4];
 void icmp_handle(void *packetData)
 {
 	ipHeader * header = packetData;
-	icmpPacket * receivedPacket = (void *)(((unsigned int)packetData) +
-		((header->verHLen & 0x0F) * 4));
+	icmpPacket * receivedPacket;
 	unsigned int checksum, packetLen;
-	char *ptr;
+	char echoBuf[ICMP_ECHO_BUF_SIZE];
 
 	packetLen = (unsigned int)(header->tLen[0] << 8 | header->tLen[1]) -
 		((header->verHLen & 0x0F) * 4);
 
+	/* Only the headers were copied from the NIC, so read the whole
+	 * message */
+	if(packetLen < sizeof(icmpPacket) || packetLen > sizeof(echoBuf))
+		return;
+
+	ne2k_frameRead(sizeof(etherPacket) + ((header->verHLen & 0x0F) * 4),
+		echoBuf, packetLen);
+	receivedPacket = (icmpPacket *)echoBuf;
+
 	switch(receivedPacket->type)
 	{
 		case ICMPPACKET_ECHO_REQUEST:
 
-			/* NOTE! We are using the original packet structure for
-			 * answering, which is usually a very ugly thing to do... */
+			/* The copy of the request is turned into the reply */
 
 			receivedPacket->type = ICMPPACKET_ECHO_REPLY;
 
 			receivedPacket->checksum[0]=0x00;
 			receivedPacket->checksum[1]=0x00;
 
-			ptr = (void *)(((unsigned int)packetData) + ((header->verHLen & 0x0F) * 4));
-			checksum = ip_calculateChecksum(ptr, packetLen);
+			checksum = ip_calculateChecksum(echoBuf, packetLen);
 
 			receivedPacket->checksum[0] = checksum >> 8;
 			receivedPacket->checksum[1] = checksum & 0xFF;
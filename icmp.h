@@ -41,4 +41,7 @@ typedef struct
 #define ICMPPACKET_ECHO_REQUEST       0x08
 #define ICMPPACKET_ECHO_REPLY         0x00
 
+/* Echo requests are answered from a buffer in the stack */
+#define ICMP_ECHO_BUF_SIZE            140
+
 #endif
@@ -32,7 +32,9 @@
 #include "gtimer.h"
 
 #include "ne2k.h"
+#include "fifo.h"
 #include <stdio.h>
+#include <avr/pgmspace.h>
 
 #include <string.h>
 
@@ -61,6 +63,12 @@ extern char localMAC[6];
 
 addrCL arpTable[MAX_ARP_ENTRIES];
 
+/*
+ * Set while ip_poll() is running
+ */
+
+static char pollRunning;
+
 /*
  * ip_initialise(ip, gateway, nmask)
  *
@@ -111,15 +119,77 @@ unsigned int ip_calculateChecksum(char *ptr, unsigned int len)
 	return checksum;
 }
 
-void ip_send(char *ip, char protocol, void *message, unsigned int msgLen)
+/*
+ * ip_checksumv(frags, count)
+ *
+ * Calculate the IP checksum over a list of fragments as if they were one
+ * contiguous buffer. The fragments use the same representation as in
+ * ne2k_sendv(), so a header, a payload in flash and a payload in a fifo can
+ * be checksummed without copying them together first.
+ */
+unsigned int ip_checksumv(const ne2kFragment *frags, unsigned char count)
+{
+	unsigned long sum = 0;
+	unsigned int cnt, i;
+	unsigned char odd = 0;
+	unsigned char chr;
+	const char *ptr;
+
+	for(i = 0; i < count; i++) {
+		ptr = frags[i].data;
+
+		for(cnt = 0; cnt < frags[i].length; cnt++) {
+			switch(frags[i].type) {
+			case NE2K_FRAGMENT_FLASH:
+				chr = pgm_read_byte(ptr + cnt);
+				break;
+			case NE2K_FRAGMENT_FIFO:
+				chr = fifo_peek((fifo *)ptr, cnt);
+				break;
+			default:
+				chr = ptr[cnt];
+				break;
+			}
+
+			/* Even bytes are the high bytes of each word */
+			sum += odd ? chr : (unsigned int)chr << 8;
+			odd ^= 1;
+		}
+	}
+
+	/* Fold the carries back into the sum */
+	while(sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+
+	return ~sum & 0xFFFF;
+}
+
+/*
+ * ip_sendv(ip, protocol, frags, count)
+ *
+ * Send an IP packet whose payload is given as a list of fragments. The IP
+ * header is prepended as one more fragment and the whole packet is written
+ * to the NIC by ne2k_sendv(), so the payload is never copied in SRAM.
+ */
+void ip_sendv(char *ip, char protocol, const ne2kFragment *frags,
+			  unsigned char count)
 {
 	unsigned int arpQueryID, cnt, checksum;
 	unsigned int useGW;
-	char ipBuf[160];
+	unsigned int msgLen = 0;
+	ne2kFragment packet[IP_MAX_FRAGMENTS + 1];
 
 	ipHeader header;
 
-	if(msgLen + sizeof(ipHeader) > sizeof(ipBuf))
+	if(count > IP_MAX_FRAGMENTS)
+		return;
+
+	for(cnt = 0; cnt < count; cnt++) {
+		msgLen += frags[cnt].length;
+		packet[cnt + 1] = frags[cnt];
+	}
+
+	if(msgLen + sizeof(ipHeader) > NE2K_MTU)
 		return;
 
 	memcpy(header.sourceIP, localIP, 4);
@@ -147,9 +217,10 @@ void ip_send(char *ip, char protocol, void *message, unsigned int msgLen)
 	header.checksum[0] = checksum >> 8;
 	header.checksum[1] = checksum & 0xFF;
 
-	/* Copy the header and data into buffer */
-	memcpy(ipBuf, (char *) &header, 20);
-	memcpy(ipBuf + 20, (char *) message, msgLen);
+	/* The header goes in front of the payload fragments */
+	packet[0].data = (char *) &header;
+	packet[0].length = sizeof(ipHeader);
+	packet[0].type = NE2K_FRAGMENT_RAM;
 
 	/* Skip ARP search if we're working on broadcast message */
 	if(memcmp((char *)&broadcastIP, ip, 4)) {
@@ -186,7 +257,8 @@ void ip_send(char *ip, char protocol, void *message, unsigned int msgLen)
 				// Wait for ARP response
 				unsigned int currTime = globalTimer;
 				while((arpTable[arpQueryID].state != ARPSTATE_ENABLED) &&
-					(globalTimer - currTime) < 40) ;
+					(globalTimer - currTime) < 40)
+					ip_poll();
 
 				// Host unavailable
 				if(arpTable[arpQueryID].state != ARPSTATE_ENABLED)
@@ -199,13 +271,30 @@ void ip_send(char *ip, char protocol, void *message, unsigned int msgLen)
 		}
 
 		arpTable[cnt].lifeTime = 600;
-		ne2k_send((char *)arpTable[cnt].MAC, ipBuf, msgLen + 20, PACKETTYPE_IP, 0);
+		ne2k_sendv((char *)arpTable[cnt].MAC, PACKETTYPE_IP, packet,
+			count + 1);
 	}
 	else
-		ne2k_send((char *)&broadcastMAC, ipBuf, msgLen + 20, PACKETTYPE_IP, 0);
+		ne2k_sendv((char *)&broadcastMAC, PACKETTYPE_IP, packet, count + 1);
 
 }
 
+/*
+ * ip_send(ip, protocol, message, msgLen)
+ *
+ * Send an IP packet whose payload is in one contiguous buffer
+ */
+void ip_send(char *ip, char protocol, void *message, unsigned int msgLen)
+{
+	ne2kFragment frag;
+
+	frag.data = message;
+	frag.length = msgLen;
+	frag.type = NE2K_FRAGMENT_RAM;
+
+	ip_sendv(ip, protocol, &frag, 1);
+}
+
 /*
  * arp_sendAliveQuery(ip)
  * 
@@ -360,6 +449,14 @@ void ip_handle(etherPacket *packetData)
 	unsigned int originalChecksum;
 	unsigned int checksum;
 
+	/* Only the headers are available in packetData, the payload is read
+	 * from the NIC by the protocol handlers. Drop truncated packets so the
+	 * handlers can rely on the total length field. */
+	if(ne2k_frameLength() < sizeof(etherPacket) +
+		((header->tLen[0] << 8) | header->tLen[1]) ||
+		(header->verHLen & 0x0F) < 5)
+		return;
+
 	/* Multiple part packets are ignored */
 	if((header->flgFrgOffset[0] != 0x00 ||
 		header->flgFrgOffset[1] != 0x00) &&
@@ -431,3 +528,32 @@ void packet_receive(etherPacket *packetData)
 		break;
 	}
 }
+
+/*
+ * ip_poll()
+ *
+ * Run the network stack: process the received frames and keep the TCP
+ * streams going. All packet processing happens here, in the main context,
+ * so every loop that waits for the network must call this function. Nested
+ * calls (e.g. while a packet handler waits for an ARP reply) return
+ * immediately.
+ */
+void ip_poll(void)
+{
+	static unsigned int lastTick;
+
+	if(pollRunning)
+		return;
+
+	pollRunning = 1;
+
+	ne2k_poll();
+
+	/* TCP streams are sustained once per timer tick */
+	if(lastTick != globalTimer) {
+		lastTick = globalTimer;
+		tcp_sustain();
+	}
+
+	pollRunning = 0;
+}
@@ -27,6 +27,8 @@
 #ifndef IP_H
 #define IP_H
 
+#include "ne2k.h"
+
 typedef struct
 {
 	char packetReceiver[6];
@@ -77,12 +79,19 @@ typedef struct
 
 void ip_initialise(const char * ip, const char * gateway, const char * nmask);
 unsigned int ip_calculateChecksum(char *ptr, unsigned int len);
+unsigned int ip_checksumv(const ne2kFragment *frags, unsigned char count);
 void ip_send(char *ip, char protocol, void *message, unsigned int msgLen);
+void ip_sendv(char *ip, char protocol, const ne2kFragment *frags,
+			  unsigned char count);
 unsigned int arp_sendquery(char *ip);
 void arp_handle(etherPacket *packetData);
 void packet_receive(etherPacket *packetData);
 void arp_sendAliveQuery(char *ip);
 void ip_initialise_dhcp(void);
+void ip_poll(void);
+
+/* Maximum number of payload fragments in ip_sendv() */
+#define IP_MAX_FRAGMENTS		3
 
 #define PACKETTYPE_ARP          0x806
 #define PACKETTYPE_IP           0x800
@@ -30,9 +30,11 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "ne2k.h"
+#include "fifo.h"
 #include "ip.h"
 #include "uart.h"
 #include "config.h"
@@ -49,7 +51,37 @@ char localMAC[6] = {'N', 'E', 'X', 'T', 'O', 'N'};
  */
 
 static char packetHeader[4];
-static char packetData[NE2K_RX_BUF_SIZE];
+static char packetData[NE2K_RX_HDR_SIZE];
+
+/*
+ * Location and length of the frame that is being processed. Only the first
+ * NE2K_RX_HDR_SIZE bytes are copied into packetData, the rest stays in the
+ * receive ring until the protocol handlers ask for it.
+ */
+
+static unsigned int rxFrameAddr;
+static unsigned int rxFrameLength;
+
+/*
+ * Receive statistics
+ */
+
+volatile ne2kStatistics ne2kStats;
+
+/*
+ * Set by the interrupt handler when there are new frames in the ring
+ */
+
+volatile static char rxPending;
+
+/*
+ * The interrupt handler accesses the NIC registers, so the NIC interrupt is
+ * masked whenever the NIC is used from the main context. Other interrupts
+ * (timer, UART) stay enabled.
+ */
+
+#define NIC_LOCK()			EIMSK &= ~_BV(INT0)
+#define NIC_UNLOCK()		EIMSK |= _BV(INT0)
 
 /*
  * Communication with the NIC is done using the following routines
@@ -128,14 +160,15 @@ void ne2k_init(void)
 	/* This is quite an ugly part... we're assuming that there is 16kB _and_ it
 	 * is mapped to start at ioAddress 0x4000
 	 */
-	NIC_WRITE(PORT_PSTART, 0x46);
-	NIC_WRITE(PORT_PSTOP, 0x60);
+	NIC_WRITE(PORT_PSTART, NE2K_RX_START);
+	NIC_WRITE(PORT_PSTOP, NE2K_RX_STOP);
 
 
-	/* Set boundary and curr registers */
-	NIC_WRITE(PORT_BNRY, 0x46);
+	/* Set boundary and curr registers. BNRY always trails the next frame to
+	 * be read by one page */
+	NIC_WRITE(PORT_BNRY, NE2K_RX_START);
 	NIC_WRITE(PORT_CMD, CMD_PAGE1 | CMD_RD2 | CMD_STP);
-	NIC_WRITE(PORT_CURR, 0x47);
+	NIC_WRITE(PORT_CURR, NE2K_RX_START + 1);
 
 	/* Load MAC address */
 	for(cnt = 0; cnt < 6; cnt++)
@@ -153,95 +186,261 @@ void ne2k_init(void)
 	/* Clear interrupt status register */
 	NIC_WRITE(PORT_ISR, 0xFF);
 
-	/* Enable received interrupt */
-	NIC_WRITE(PORT_IMR, 0x01);
+	/* Enable received, receive error and overwrite warning interrupts */
+	NIC_WRITE(PORT_IMR, ISR_PRX | ISR_RXE | ISR_OVW);
+}
+
+/*
+ * ne2k_readMemory(addr, buf, f, len)
+ *
+ * Read a block from the NIC buffer memory using remote DMA. The data is
+ * stored either to buf or, if f is given, to the fifo. The read is split in
+ * two if the block crosses the end of the receive ring.
+ */
+static void ne2k_readMemory(unsigned int addr, char *buf, fifo *f,
+							unsigned int len)
+{
+	unsigned int cnt, chunk;
+
+	while(len) {
+		chunk = len;
+		if(addr < (NE2K_RX_STOP << 8) && addr + chunk > (NE2K_RX_STOP << 8))
+			chunk = (NE2K_RX_STOP << 8) - addr;
+
+		NIC_WRITE(PORT_RSAR0, addr & 0xFF);
+		NIC_WRITE(PORT_RSAR1, addr >> 8);
+		NIC_WRITE(PORT_RBCR0, chunk & 0xFF);
+		NIC_WRITE(PORT_RBCR1, chunk >> 8);
+		NIC_WRITE(PORT_CMD, CMD_RD0 | CMD_STA);
+
+		if(f) {
+			for(cnt = 0; cnt < chunk; cnt++)
+				fifo_putc(f, NIC_READ(PORT_DMA));
+		} else {
+			for(cnt = 0; cnt < chunk; cnt++)
+				buf[cnt] = NIC_READ(PORT_DMA);
+			buf += chunk;
+		}
+
+		NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_STA);
+
+		len -= chunk;
+		addr += chunk;
+
+		/* Continue from the beginning of the ring */
+		if(addr == (NE2K_RX_STOP << 8))
+			addr = NE2K_RX_START << 8;
+	}
+}
+
+/*
+ * ne2k_copyFrame(offset, buf, f, len)
+ *
+ * Read a part of the received frame directly from the receive ring. The
+ * offset is counted from the beginning of the ethernet header. The data is
+ * stored to buf, or to the fifo f if it is given. Returns the number of
+ * bytes read, which is less than len if the frame is shorter or the fifo
+ * does not have room for all of the data.
+ */
+static unsigned int ne2k_copyFrame(unsigned int offset, char *buf, fifo *f,
+									unsigned int len)
+{
+	unsigned int addr, space;
+
+	if(offset >= rxFrameLength)
+		return 0;
+
+	if(len > rxFrameLength - offset)
+		len = rxFrameLength - offset;
+
+	if(f) {
+		space = fifo_size(f) - fifo_length(f) - 1;
+		if(len > space)
+			len = space;
+	}
+
+	/* Wrap the address around the ring */
+	addr = rxFrameAddr + offset;
+	if(addr >= (NE2K_RX_STOP << 8))
+		addr -= (NE2K_RX_STOP - NE2K_RX_START) << 8;
+
+	NIC_LOCK();
+	ne2k_readMemory(addr, buf, f, len);
+	NIC_UNLOCK();
+
+	return len;
+}
+
+/*
+ * ne2k_frameLength()
+ *
+ * Returns the length of the received frame that is being processed.
+ */
+unsigned int ne2k_frameLength(void)
+{
+	return rxFrameLength;
+}
+
+/*
+ * ne2k_frameRead(offset, buf, len)
+ *
+ * Copy a part of the received frame into buf. The offset is counted from
+ * the beginning of the ethernet header. Returns the number of bytes copied.
+ */
+unsigned int ne2k_frameRead(unsigned int offset, char *buf, unsigned int len)
+{
+	return ne2k_copyFrame(offset, buf, 0, len);
+}
+
+/*
+ * ne2k_frameReadFifo(offset, f, len)
+ *
+ * Stream a part of the received frame into the fifo without an intermediate
+ * buffer. Returns the number of bytes stored into the fifo.
+ */
+unsigned int ne2k_frameReadFifo(unsigned int offset, fifo *f, unsigned int len)
+{
+	return ne2k_copyFrame(offset, 0, f, len);
 }
 
 /*
  * Receive interrupt handler
+ *
+ * The handler only acknowledges the NIC and marks that there are frames
+ * waiting in the receive ring. The frames themselves are processed in
+ * ne2k_poll(), outside of the interrupt context.
  */
 SIGNAL (SIG_INTERRUPT0) 
 {
-
-	unsigned int cnt, packetSize;
 	char status;
-	char currPage, lastPage;
-	
-	NIC_WRITE(PORT_CMD, CMD_RD2);
-	NIC_WRITE(PORT_ISR, 0xFF);
+
+	/* Read and acknowledge the interrupt status */
 	NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_STA);
+	status = NIC_READ(PORT_ISR);
+	NIC_WRITE(PORT_ISR, status);
 
-	/* Did the NIC receive the packet properly? */
-	status = NIC_READ(PORT_RSR);
+	/* Receive errors (CRC, frame alignment, missed packets) */
+	if(status & ISR_RXE)
+		ne2kStats.rxLost++;
 
-	if(status & 0x01) {
+	if(status & (ISR_PRX | ISR_OVW))
+		rxPending = 1;
+}
+
+/*
+ * ne2k_poll()
+ *
+ * Process the frames waiting in the receive ring. The ring is used from
+ * NE2K_RX_START to NE2K_RX_STOP: the NIC writes new frames at CURR, and BNRY
+ * points to the page just before the next unread frame. Frames are consumed
+ * one by one and BNRY is moved forward after each of them, so the receiver
+ * keeps running all the time.
+ *
+ * Only the headers of each frame are copied into SRAM before the frame is
+ * handed to the stack. The protocol handlers pull the payload straight from
+ * the ring using ne2k_frameRead() and ne2k_frameReadFifo(), and the frame is
+ * released after the handlers return. The NIC interrupt is masked only while
+ * the NIC is being accessed. The function must be called from the main
+ * context. Returns the number of frames delivered.
+ */
+unsigned int ne2k_poll(void)
+{
+	unsigned int packetSize, frames = 0;
+	char currPage, nextPage;
+
+	if(!rxPending)
+		return 0;
+
+	rxPending = 0;
 
-		/* Disable receiver */
-		NIC_WRITE(PORT_RCR, RCR_MON);
+	while(1) {
+
+		NIC_LOCK();
 
 		/* Read the value of CURR-register */
-		NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_PAGE1);
-		lastPage = NIC_READ(PORT_CURR);
-		NIC_WRITE(PORT_CMD, CMD_RD2);
+		NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_PAGE1 | CMD_STA);
+		currPage = NIC_READ(PORT_CURR);
+		NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_STA);
+
+		/* The next unread frame is located right after the boundary */
+		nextPage = NIC_READ(PORT_BNRY) + 1;
+		if(nextPage >= NE2K_RX_STOP)
+			nextPage = NE2K_RX_START;
+
+		/* Is the ring empty? */
+		if(nextPage == currPage) {
+			NIC_UNLOCK();
+			break;
+		}
 
-		currPage = 0x47;
+		ne2k_readMemory(nextPage << 8, packetHeader, 0, sizeof(packetHeader));
 
-		while(lastPage != currPage) {
-			NIC_WRITE(PORT_RSAR0, 0x00);
-			NIC_WRITE(PORT_RSAR1, currPage);
-			NIC_WRITE(PORT_RBCR0, 0x04);
-			NIC_WRITE(PORT_RBCR1, 0x00);
+		packetSize = (packetHeader[3] << 8) | packetHeader[2];
 
-			NIC_WRITE(PORT_CMD, CMD_RD0);
+		/* The header is corrupted. Drop everything that is in the ring */
+		if(packetHeader[1] < NE2K_RX_START || packetHeader[1] >= NE2K_RX_STOP ||
+			packetSize < 4 + 14 || packetSize > 4 + 1518) {
 
-			for(cnt=0; cnt < 4; cnt++)
-				packetHeader[cnt] = NIC_READ(PORT_DMA);
+			ne2kStats.rxLost++;
+			NIC_WRITE(PORT_BNRY, currPage == NE2K_RX_START ?
+				NE2K_RX_STOP - 1 : currPage - 1);
+			NIC_UNLOCK();
+			break;
+		}
 
-			packetSize = (packetHeader[3] << 8) | packetHeader[2];
+		packetSize -= 4;
 
-			if((packetSize > 4) && (packetSize < sizeof(packetData))) {
+		/* Copy the headers. The payload is left in the ring */
+		rxFrameAddr = (nextPage << 8) + 4;
+		rxFrameLength = packetSize;
 
-				packetSize-=4;
+		ne2k_readMemory(rxFrameAddr, packetData, 0,
+			packetSize < sizeof(packetData) ? packetSize : sizeof(packetData));
 
-				NIC_WRITE(PORT_RSAR0, 0x04);
-				NIC_WRITE(PORT_RSAR1, currPage);
-				NIC_WRITE(PORT_RBCR0, packetSize & 0xFF);
-				NIC_WRITE(PORT_RBCR1, packetSize >> 8);
-				NIC_WRITE(PORT_CMD, CMD_RD0);
+		NIC_UNLOCK();
 
-				for(cnt=0;cnt<packetSize; cnt++)
-					packetData[cnt]=NIC_READ(PORT_DMA);
+		ne2kStats.rxFrames++;
+		frames++;
+		packet_receive((etherPacket *) packetData);
 
-				packet_receive((etherPacket *) packetData);
-			}
+		/* Release the frame */
+		NIC_LOCK();
 
-			currPage = packetHeader[1];
-		}
+		nextPage = packetHeader[1];
+		NIC_WRITE(PORT_BNRY, nextPage == NE2K_RX_START ?
+			NE2K_RX_STOP - 1 : nextPage - 1);
+
+		NIC_UNLOCK();
 
-		/* Reset boundary and current page registers */
-		NIC_WRITE(PORT_BNRY, 0x46);
-		NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_PAGE1);
-		NIC_WRITE(PORT_CURR, 0x47);
-		NIC_WRITE(PORT_CMD, CMD_RD2);
-
-		/* Enable receiver */
-		NIC_WRITE(PORT_RCR, RCR_AB);
-	} else {
-		if(status & 0x06)
-			NIC_WRITE(PORT_CURR, 0x46);	
+		rxFrameLength = 0;
 	}
+
+	return frames;
 }
 
 
-void ne2k_send(char *net_addr, char *msg, unsigned int length,
-			   unsigned int type, unsigned int intstatus)
+/*
+ * ne2k_sendv(net_addr, type, frags, count)
+ *
+ * Transmit a frame whose payload is given as a list of fragments. The
+ * fragments are written into the NIC buffer memory one after another during
+ * a single remote DMA write, so the frame never needs to be assembled in
+ * SRAM.
+ */
+void ne2k_sendv(const char *net_addr, unsigned int type,
+				const ne2kFragment *frags, unsigned char count)
 {
-	unsigned int cnt;
+	unsigned int cnt, i;
+	unsigned int length = 0;
 	unsigned int packetLength;
+	const char *ptr;
+	fifo *f;
 
-	/* Disable interrupts to avoid concurrency issues with the receiver */
-	cli();
-	_delay_us(1);
+	for(i = 0; i < count; i++)
+		length += frags[i].length;
+
+	if(length > NE2K_MTU)
+		return;
 
 	/* Calculate the actual packet length */
 	if(length>=46)
@@ -249,11 +448,14 @@ void ne2k_send(char *net_addr, char *msg, unsigned int length,
 	else
 		packetLength = 60;
 
+	/* Keep the interrupt handler away from the NIC registers */
+	NIC_LOCK();
+
 	/* Select first page */
 	NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_STA);
 
 	/* Inform that we're going to write data using DMA */
-	NIC_WRITE(PORT_RSAR1, 0x40);
+	NIC_WRITE(PORT_RSAR1, NE2K_TX_START);
 	NIC_WRITE(PORT_RSAR0, 0x00);
 	NIC_WRITE(PORT_RBCR1, (char)(packetLength >> 8));
 	NIC_WRITE(PORT_RBCR0, (char)(packetLength & 0xFF));
@@ -271,26 +473,57 @@ void ne2k_send(char *net_addr, char *msg, unsigned int length,
 	NIC_WRITE(PORT_DMA, (char)(type >> 8));
 	NIC_WRITE(PORT_DMA, (char)(type & 0xFF));
 
-	/* ..and finally, send the data */
-	for(cnt=0;cnt<length;cnt++)
-		NIC_WRITE(PORT_DMA, msg[cnt]);
+	/* ..and finally, send the data fragment by fragment */
+	for(i = 0; i < count; i++) {
+		ptr = frags[i].data;
+
+		switch(frags[i].type) {
+		case NE2K_FRAGMENT_RAM:
+			for(cnt = 0; cnt < frags[i].length; cnt++)
+				NIC_WRITE(PORT_DMA, ptr[cnt]);
+			break;
+		case NE2K_FRAGMENT_FLASH:
+			for(cnt = 0; cnt < frags[i].length; cnt++)
+				NIC_WRITE(PORT_DMA, pgm_read_byte(ptr + cnt));
+			break;
+		case NE2K_FRAGMENT_FIFO:
+			f = (fifo *)ptr;
+			for(cnt = 0; cnt < frags[i].length; cnt++)
+				NIC_WRITE(PORT_DMA, fifo_peek(f, cnt));
+			break;
+		}
+	}
 
 	/* Fill rest of the packet if the data part is less than 46 bytes long */
-	if (length < 46) {
-		for(; cnt < 46; cnt++)
-			NIC_WRITE(PORT_DMA, 0x00);
-	}
+	for(; length < 46; length++)
+		NIC_WRITE(PORT_DMA, 0x00);
 
 	/* Stop the DMA operation (if it's not already finished) */
 	NIC_WRITE(PORT_CMD, CMD_RD2 | CMD_STA);
 
-	NIC_WRITE(PORT_TPSR, 0x40);
+	NIC_WRITE(PORT_TPSR, NE2K_TX_START);
 	NIC_WRITE(PORT_TBCR1, (char)(packetLength >> 8));
 	NIC_WRITE(PORT_TBCR0, (char)(packetLength & 0xFF));
 
 	/* Send the packet */
 	NIC_WRITE(PORT_CMD, CMD_RD1 | CMD_RD2 | CMD_TXP | CMD_STA);
 
-	/* Re-enable interrupts */
-	sei();
+	NIC_UNLOCK();
+}
+
+/*
+ * ne2k_send(net_addr, msg, length, type, intstatus)
+ *
+ * Transmit a frame whose payload is in one contiguous buffer
+ */
+void ne2k_send(char *net_addr, char *msg, unsigned int length,
+			   unsigned int type, unsigned int intstatus)
+{
+	ne2kFragment frag;
+
+	frag.data = msg;
+	frag.length = length;
+	frag.type = NE2K_FRAGMENT_RAM;
+
+	ne2k_sendv(net_addr, type, &frag, 1);
 }
@@ -27,8 +27,40 @@
 #ifndef NE2K_H
 #define NE2K_H
 
+#include "fifo.h"
+
+/*
+ * A piece of a frame to be transmitted. The data can be located in SRAM, in
+ * flash or in a fifo. For fifos, data points to the fifo structure and the
+ * bytes are taken from the read pointer onwards without removing them.
+ */
+typedef struct
+{
+	const char *data;
+	unsigned int length;
+	char type;
+} ne2kFragment;
+
+#define NE2K_FRAGMENT_RAM		0
+#define NE2K_FRAGMENT_FLASH		1
+#define NE2K_FRAGMENT_FIFO		2
+
+typedef struct
+{
+	unsigned long rxFrames;
+	unsigned long rxLost;
+} ne2kStatistics;
+
+extern volatile ne2kStatistics ne2kStats;
+
 void ne2k_init(void);
+unsigned int ne2k_poll(void);
+unsigned int ne2k_frameLength(void);
+unsigned int ne2k_frameRead(unsigned int offset, char *buf, unsigned int len);
+unsigned int ne2k_frameReadFifo(unsigned int offset, fifo *f, unsigned int len);
 void ne2k_send(char *net_addr, char *msg, unsigned int length, unsigned int type, unsigned int intstatus);
+void ne2k_sendv(const char *net_addr, unsigned int type,
+				const ne2kFragment *frags, unsigned char count);
 
 #define NIC_DATA_PORT		PORTA
 #define NIC_CNTRL_PORT		PORTC
@@ -40,6 +72,14 @@ void ne2k_send(char *net_addr, char *msg, unsigned int length, unsigned int type
 #define NIC_DATA_OUT		PORTA
 #define NIC_DATA_IN			PINA
 
+/* Maximum payload of an ethernet frame */
+#define NE2K_MTU			1500
+
+/* Buffer memory layout (in 256 byte pages) */
+#define NE2K_TX_START		0x40
+#define NE2K_RX_START		0x46
+#define NE2K_RX_STOP		0x60
+
 /* The declaration list of commands is not complete.. there are only commands the driver needs */
 
 #define PORT_CMD    0x00
@@ -94,6 +134,9 @@ void ne2k_send(char *net_addr, char *msg, unsigned int length, unsigned int type
 
 #define ISR_PRX     0x01
 #define ISR_PTX     0x02
+#define ISR_RXE     0x04
+#define ISR_TXE     0x08
+#define ISR_OVW     0x10
 
 #define DCR_DEF     0x80
 #define DCR_LS      0x08
@@ -29,6 +29,7 @@
 
 #include "ip.h"
 #include "udp.h"
+#include "ne2k.h"
 #include "config.h"
 
 /*
@@ -37,9 +38,6 @@
  */
 extern char localIP[4];
 
-/* Buffer to preserve a packet before char it... */
-static char buf[256];
-
 /* UDP-sockets */
 udpSocket sockets[MAX_UDP_SOCKETS];
 
@@ -66,39 +64,48 @@ void udp_send(char *dest, unsigned int lPort, unsigned int dPort,
 			char *msg, unsigned int len)
 {
 	unsigned int checksum;
-	udpPseudoHeader * newPacketPH = (udpPseudoHeader *)&buf;
-	udpPacket * newPacket = (udpPacket *)&buf[12];
+	udpPseudoHeader newPacketPH;
+	udpPacket newPacket;
+	ne2kFragment frags[3];
 
 	/* Generate a pseudo header */
-	memcpy(newPacketPH->sourceIP, localIP, 4);
-	memcpy(newPacketPH->destIP, dest, 4);
-	newPacketPH->protocol=IPPACKETTYPE_UDP;
-	newPacketPH->zeroByte=0x00;
-	newPacketPH->pLen[0] = (len + 8) >> 8;
-	newPacketPH->pLen[1] = (len + 8) & 0xFF;
+	memcpy(newPacketPH.sourceIP, localIP, 4);
+	memcpy(newPacketPH.destIP, dest, 4);
+	newPacketPH.protocol=IPPACKETTYPE_UDP;
+	newPacketPH.zeroByte=0x00;
+	newPacketPH.pLen[0] = (len + 8) >> 8;
+	newPacketPH.pLen[1] = (len + 8) & 0xFF;
 
 	/* Generate the real header */
-	newPacket->lPort[0] = lPort >> 8;
-	newPacket->lPort[1] = lPort & 0xFF;
-	newPacket->dPort[0] = dPort >> 8;
-	newPacket->dPort[1] = dPort & 0xFF;
-	newPacket->len[0] = (len + 8) >> 8;
-	newPacket->len[1] = (len + 8) & 0xFF;
-	newPacket->checksum[0] = 0x00;
-	newPacket->checksum[1] = 0x00;
-
-	/* Copy message */
-	memcpy(buf + 20, msg, len);
+	newPacket.lPort[0] = lPort >> 8;
+	newPacket.lPort[1] = lPort & 0xFF;
+	newPacket.dPort[0] = dPort >> 8;
+	newPacket.dPort[1] = dPort & 0xFF;
+	newPacket.len[0] = (len + 8) >> 8;
+	newPacket.len[1] = (len + 8) & 0xFF;
+	newPacket.checksum[0] = 0x00;
+	newPacket.checksum[1] = 0x00;
+
+	/* The pseudo header, the header and the message are kept apart */
+	frags[0].data = (char *)&newPacketPH;
+	frags[0].length = sizeof(newPacketPH);
+	frags[0].type = NE2K_FRAGMENT_RAM;
+	frags[1].data = (char *)&newPacket;
+	frags[1].length = sizeof(newPacket);
+	frags[1].type = NE2K_FRAGMENT_RAM;
+	frags[2].data = msg;
+	frags[2].length = len;
+	frags[2].type = NE2K_FRAGMENT_RAM;
 
 	/* Calculate a checksum for the packet */
-	checksum = ip_calculateChecksum(buf, len + 20);
+	checksum = ip_checksumv(frags, 3);
 
 	/* Insert checksum */
-	newPacket->checksum[0] = checksum >> 8;
-	newPacket->checksum[1] = checksum & 0xFF;
+	newPacket.checksum[0] = checksum >> 8;
+	newPacket.checksum[1] = checksum & 0xFF;
 
-	/* Send */
-	ip_send(dest, IPPACKETTYPE_UDP, &buf[12], len + 8);
+	/* Send (without the pseudo header) */
+	ip_sendv(dest, IPPACKETTYPE_UDP, &frags[1], 2);
 }
 
 
@@ -176,7 +183,8 @@ void udp_handle(void *packetData)
 				sockets[i].state = SOCKETSTATE_ESTABLISHED;
 				sockets[i].dLen =
 					(((packet->len[0] << 8) | packet->len[1]) - 8);
-				memcpy(sockets[i].dbuf, (char *)packet + 8,
+				ne2k_frameRead(sizeof(etherPacket) +
+					((header->verHLen & 0x0F) * 4) + 8, sockets[i].dbuf,
 					(((packet->len[0] << 8) | packet->len[1]) - 8));
 				memcpy((char *)sockets[i].sourceIP, header->sourceIP, 4);
 			}